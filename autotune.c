@@ -0,0 +1,225 @@
+#define _DEFAULT_SOURCE // clock_gettime and sysconf with -std=c11
+#include <unistd.h>
+
+#include "ml.h"
+
+// Finds the fastest mat_mult settings for this machine and saves them in the tuning file,
+// under the CPU model and batch size, so one file can hold the settings of several machines
+// and the programs only pick up settings tuned for the batch size they run at.
+// The candidates are timed on the products that training the network in train.c does:
+// the forward pass, the deltas through the transposed weights and the weight gradients.
+// First the tile size is picked with one thread, then the thread count, together with the
+// smallest product that is worth splitting between the threads.
+// Only training runs mat_mult, inference has its own kernels without settings. At batch size 1 the
+// forward and delta products are matrix-vector products, which don't use the tile size, so the
+// tile size only matters for the weight gradient, and the fused mode has none of those.
+//
+// Usage: ./autotune [batch]
+// The batch size defaults to 1, which is what train.c uses.
+
+#define MAX_SHAPES 32
+
+static const size_t blocks[] = { 16, 32, 64, 128, 256 };
+
+typedef struct Shape
+{
+    Mat dst, a, b;
+    size_t work; // Multiply-adds
+} Shape;
+
+Shape shape_alloc(size_t rows, size_t inner, size_t cols)
+{
+    Shape s;
+    s.dst = mat_alloc(rows, cols);
+    s.a = mat_alloc(rows, inner);
+    s.b = mat_alloc(inner, cols);
+    mat_rand(s.a, -1.0, 1.0);
+    mat_rand(s.b, -1.0, 1.0);
+    s.work = rows * inner * cols;
+    return s;
+}
+
+// Best of a few runs, each repeated until it is long enough to time
+double time_mult(Shape s)
+{
+    double best = INFINITY;
+    for (int run = 0; run < 5; run++) {
+        size_t reps = 0;
+        double start = now();
+        do {
+            mat_mult(s.dst, s.a, s.b);
+            reps++;
+        } while (now() - start < 0.01);
+        best = fmin(best, (now() - start) / (double) reps);
+    }
+
+    return best;
+}
+
+// Rewrites the tuning file with ml_tuning for this CPU and batch size, and keeps the other sections
+void save_tuning(char *filename, char *cpu, size_t batch)
+{
+    char *kept = NULL;
+    size_t length = 0;
+
+    char header[512];
+    snprintf(header, sizeof(header), "[%s] batch %zu\n", cpu, batch);
+
+    FILE *f = fopen(filename, "r");
+    if (f != NULL) {
+        int match = 0;
+        char line[512];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (line[0] == '[') {
+                match = strcmp(line, header) == 0;
+            }
+            if (match) {
+                continue;
+            }
+
+            size_t n = strlen(line);
+            kept = realloc(kept, length + n + 1);
+            assert(kept != NULL);
+            memcpy(kept + length, line, n + 1);
+            length += n;
+        }
+        fclose(f);
+    }
+
+    f = fopen(filename, "w");
+    if (f == NULL) {
+        perror("fopen failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (kept != NULL) {
+        fputs(kept, f);
+    }
+    fputs(header, f);
+    fprintf(f, "block %zu\n", ml_tuning.block);
+    fprintf(f, "threads %zu\n", ml_tuning.threads);
+    fprintf(f, "parallel_min %zu\n", ml_tuning.parallel_min);
+
+    if (ferror(f)) {
+        perror("fprintf failed while saving tuning");
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    free(kept);
+}
+
+int main(int argc, char **argv)
+{
+    srand(time(NULL));
+
+    size_t batch = 1;
+    if (argc > 1) {
+        long b = strtol(argv[1], NULL, 10);
+        if (b < 1) {
+            fprintf(stderr, "Batch size must be at least 1\n");
+            return EXIT_FAILURE;
+        }
+        batch = (size_t) b;
+    }
+
+    char cpu[256];
+    ml_cpu_model(cpu, sizeof(cpu));
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t cpus = online > 0 ? (size_t) online : 1;
+    printf("Tuning for %s with %zu CPUs and batch size %zu\n", cpu, cpus, batch);
+
+    // The products of one training step of the network in train.c
+    size_t arch[] = { 28*28, 1000, 100, 10 };
+    Shape shapes[MAX_SHAPES];
+    size_t count = 0;
+    for (size_t i = 0; i < sizeof(arch)/sizeof(size_t) - 1; i++) {
+        shapes[count++] = shape_alloc(arch[i+1], arch[i], batch); // Forward
+        shapes[count++] = shape_alloc(arch[i+1], batch, arch[i]); // Weight gradient
+        if (i > 0) {
+            shapes[count++] = shape_alloc(arch[i], arch[i+1], batch); // Deltas for the layer below
+        }
+    }
+
+    // Tile size, on one thread
+    double single[MAX_SHAPES];
+    double best_total = INFINITY;
+    size_t best_block = ml_tuning.block;
+    ml_tuning.threads = 1;
+    printf("\n%8s %12s\n", "block", "ms/step");
+    for (size_t c = 0; c < sizeof(blocks)/sizeof(blocks[0]); c++) {
+        ml_tuning.block = blocks[c];
+        double times[MAX_SHAPES];
+        double total = 0.0;
+        for (size_t s = 0; s < count; s++) {
+            times[s] = time_mult(shapes[s]);
+            total += times[s];
+        }
+        printf("%8zu %12.3f\n", blocks[c], total * 1e3);
+
+        if (total < best_total) {
+            best_total = total;
+            best_block = blocks[c];
+            memcpy(single, times, sizeof(times));
+        }
+    }
+    ml_tuning.block = best_block;
+
+    // Thread count, and the smallest product that uses the threads.
+    // Each threshold is tried at the size of one of the shapes, and one thread is kept if nothing beats it.
+    size_t candidates[ML_MAX_THREADS];
+    size_t candidate_count = 0;
+    for (size_t t = 2; t < cpus && t < ML_MAX_THREADS; t *= 2) {
+        candidates[candidate_count++] = t;
+    }
+    if (cpus > 1) {
+        candidates[candidate_count++] = cpus < ML_MAX_THREADS ? cpus : ML_MAX_THREADS;
+    }
+
+    size_t best_threads = 1;
+    size_t best_min = ml_tuning.parallel_min;
+    printf("\n%8s %12s %14s\n", "threads", "ms/step", "parallel_min");
+    for (size_t c = 0; c < candidate_count; c++) {
+        size_t threads = candidates[c];
+        ml_tuning.threads = threads;
+        ml_tuning.parallel_min = 0;
+        double parallel[MAX_SHAPES];
+        for (size_t s = 0; s < count; s++) {
+            parallel[s] = time_mult(shapes[s]);
+        }
+
+        double threads_total = INFINITY;
+        size_t threads_min = 0;
+        for (size_t t = 0; t < count; t++) {
+            double total = 0.0;
+            for (size_t s = 0; s < count; s++) {
+                total += shapes[s].work >= shapes[t].work ? parallel[s] : single[s];
+            }
+            if (total < threads_total) {
+                threads_total = total;
+                threads_min = shapes[t].work;
+            }
+        }
+        printf("%8zu %12.3f %14zu\n", threads, threads_total * 1e3, threads_min);
+
+        if (threads_total < best_total) {
+            best_total = threads_total;
+            best_threads = threads;
+            best_min = threads_min;
+        }
+    }
+    ml_tuning.threads = best_threads;
+    ml_tuning.parallel_min = best_min;
+
+    printf("\nBest: block %zu, %zu threads, parallel_min %zu, %.3f ms per step\n",
+           ml_tuning.block, ml_tuning.threads, ml_tuning.parallel_min, best_total * 1e3);
+    save_tuning("tuning", cpu, batch);
+    printf("Saved to tuning for batch size %zu\n", batch);
+
+    for (size_t s = 0; s < count; s++) {
+        mat_free(shapes[s].dst);
+        mat_free(shapes[s].a);
+        mat_free(shapes[s].b);
+    }
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include "ml.h"
+
+// Exports a trained network as a C source file for main to be compiled with.
+// The packed weights and biases from inf_alloc become static const arrays, and the activations
+// become static buffers, so the classifier needs no allocation, no random initialisation and no
+// file reading at startup. The file defines model_inference(), see STATIC_MODEL in main.c.
+//
+// Usage: ./export [weights] [output]
+// Reads weights_and_biases and writes model.c by default.
+
+// Doubles per line, one packed column of a panel
+#define PER_LINE INF_PANEL
+
+void write_array(FILE *f, const char *type, const char *name, size_t i, const double *data, size_t count)
+{
+    fprintf(f, "static _Alignas(64) %s model_%s%zu[%zu]", type, name, i, count);
+    if (data == NULL) {
+        fprintf(f, ";\n");
+        return;
+    }
+
+    // Hex floats round trip exactly
+    fprintf(f, " = {\n");
+    for (size_t j = 0; j < count; j++) {
+        fprintf(f, j % PER_LINE == 0 ? "    %a," : " %a,", data[j]);
+        if (j % PER_LINE == PER_LINE - 1 || j == count - 1) {
+            fprintf(f, "\n");
+        }
+    }
+    fprintf(f, "};\n");
+}
+
+void export_inference(Inference e, char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        perror("fopen failed");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(f, "// Generated by export, do not edit\n");
+    fprintf(f, "#define ML_IMPLEMENTATION // Only the declarations\n");
+    fprintf(f, "#include \"ml.h\"\n\n");
+
+    fprintf(f, "static size_t model_sizes[] = {");
+    for (size_t i = 0; i < e.layer_count; i++) {
+        fprintf(f, i == 0 ? " %zu" : ", %zu", e.sizes[i]);
+    }
+    fprintf(f, " };\n\n");
+
+    // Same padding as inf_alloc, so inf_gemv can run on the arrays as they are
+    for (size_t i = 0; i < e.layer_count - 1; i++) {
+        size_t padded = inf_padded(e.sizes[i+1]);
+        write_array(f, "const double", "w", i, e.ws[i], padded * e.sizes[i]);
+        write_array(f, "const double", "b", i, e.bs[i], padded);
+        write_array(f, "double", "a", i+1, NULL, padded);
+        fprintf(f, "\n");
+    }
+
+    fprintf(f, "static const double *model_ws[] = {");
+    for (size_t i = 0; i < e.layer_count - 1; i++) {
+        fprintf(f, i == 0 ? " model_w%zu" : ", model_w%zu", i);
+    }
+    fprintf(f, " };\n");
+    fprintf(f, "static const double *model_bs[] = {");
+    for (size_t i = 0; i < e.layer_count - 1; i++) {
+        fprintf(f, i == 0 ? " model_b%zu" : ", model_b%zu", i);
+    }
+    fprintf(f, " };\n");
+    fprintf(f, "static double *model_as[] = { NULL"); // The input is read straight from the matrix passed to inf_forward
+    for (size_t i = 1; i < e.layer_count; i++) {
+        fprintf(f, ", model_a%zu", i);
+    }
+    fprintf(f, " };\n\n");
+
+    fprintf(f, "// Not allocated, so it must not be passed to inf_free\n");
+    fprintf(f, "Inference model_inference(void)\n{\n");
+    fprintf(f, "    Inference e;\n");
+    fprintf(f, "    e.layer_count = %zu;\n", e.layer_count);
+    fprintf(f, "    e.head = %s;\n", e.head == HEAD_SOFTMAX ? "HEAD_SOFTMAX" : "HEAD_SIGMOID");
+    fprintf(f, "    e.sizes = model_sizes;\n");
+    fprintf(f, "    e.ws = model_ws;\n");
+    fprintf(f, "    e.sparse = NULL;\n");
+    fprintf(f, "    e.bs = model_bs;\n");
+    fprintf(f, "    e.as = model_as;\n");
+    fprintf(f, "    return e;\n}\n");
+
+    if (ferror(f)) {
+        perror("fprintf failed while exporting network");
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+    char *weights = argc > 1 ? argv[1] : "weights_and_biases";
+    char *output = argc > 2 ? argv[2] : "model.c";
+
+    size_t arch[] = { 28*28, 1000, 100, 10 };
+    Network n = net_alloc(sizeof(arch)/sizeof(size_t), arch);
+    n.head = HEAD_SOFTMAX; // net_load checks it against the head train saved
+    net_load(n, weights);
+
+    Inference e = inf_alloc(n);
+    export_inference(e, output);
+    printf("Exported %s to %s (%zu parameters)\n", weights, output, net_param_count(n));
+
+    inf_free(e);
+    net_free(n);
+
+    return 0;
+}
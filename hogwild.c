@@ -0,0 +1,139 @@
+#include <pthread.h>
+
+#include "ml.h"
+#include "mnist.h"
+
+// Hogwild training on MNIST, compared against the normal synchronous trainer.
+// Every thread runs net_forward and net_backprop on its own samples with its own activations
+// and gradient (see net_alloc_workspace), and subtracts its updates from the shared weights and
+// biases without any locking. The races are deliberate: each update only touches a small part
+// of the parameters, and a lost or stale update now and then costs less than synchronising.
+//
+// Usage: ./hogwild [threads]
+
+#define MAX_THREADS 64
+
+typedef struct Job
+{
+    Network n; // Workspace sharing the parameters
+    Mat images;
+    Mat labels;
+    size_t first, count;
+    double learning_rate;
+} Job;
+
+void *hogwild_worker(void *arg)
+{
+    Job *job = arg;
+    for (size_t i = job->first; i < job->first + job->count; i++) {
+        net_train(job->n, sample_at(job->images, i), sample_at(job->labels, i), job->learning_rate);
+    }
+
+    return NULL;
+}
+
+// Returns the accuracy in percent and stores the mean loss
+double evaluate(Network n, Mat images, Mat labels, size_t C, double *loss)
+{
+    int correct_guesses = 0;
+    double total = 0.0;
+    for (size_t i = 0; i < C; i++) {
+        net_bind_input(n, sample_at(images, i));
+        total += net_loss(n, sample_at(labels, i));
+        if (mat_to_label(NET_OUT(n)) == mat_to_label(sample_at(labels, i))) {
+            correct_guesses++;
+        }
+    }
+
+    *loss = total / (double) C;
+    return (double) correct_guesses / (double) C * 100.0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t threads = 4;
+    if (argc > 1) {
+        long t = strtol(argv[1], NULL, 10);
+        if (t < 1 || t > MAX_THREADS) {
+            fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+            return EXIT_FAILURE;
+        }
+        threads = (size_t) t;
+    }
+
+    size_t N = 60000;
+    size_t C = 10000;
+
+    Mat labels = read_labels("datasets/train-labels-idx1-ubyte/train-labels.idx1-ubyte", N);
+    Mat images = read_inputs("datasets/train-images-idx3-ubyte/train-images.idx3-ubyte", N);
+    Mat test_labels = read_labels("datasets/t10k-labels-idx1-ubyte", C);
+    Mat test_images = read_inputs("datasets/t10k-images-idx3-ubyte", C);
+
+    double learning_rate = 0.01;
+    size_t epochs = 5;
+    size_t arch[] = { 28*28, 1000, 100, 10 };
+    unsigned int seed = time(NULL);
+
+    // Both trainers start from the same parameters
+    srand(seed);
+    Network sync = net_alloc(sizeof(arch)/sizeof(size_t), arch);
+    srand(seed);
+    Network hogwild = net_alloc(sizeof(arch)/sizeof(size_t), arch);
+    sync.head = HEAD_SOFTMAX; // Same head as train, the workspaces copy it
+    hogwild.head = HEAD_SOFTMAX;
+
+    Job jobs[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    for (size_t t = 0; t < threads; t++) {
+        jobs[t].n = net_alloc_workspace(hogwild);
+        jobs[t].images = images;
+        jobs[t].labels = labels;
+        jobs[t].first = t * N / threads;
+        jobs[t].count = (t + 1) * N / threads - jobs[t].first;
+        jobs[t].learning_rate = learning_rate;
+    }
+
+    printf("%5s | %10s %8s %9s | %10s %8s %9s\n", "epoch",
+           "sync s/s", "loss", "accuracy", "hogwild s/s", "loss", "accuracy");
+
+    for (size_t e = 0; e < epochs; e++) {
+        double start = now();
+        for (size_t i = 0; i < N; i++) {
+            net_train(sync, sample_at(images, i), sample_at(labels, i), learning_rate);
+        }
+        double sync_time = now() - start;
+
+        // Joining the threads is the only synchronisation, once per epoch
+        start = now();
+        for (size_t t = 0; t < threads; t++) {
+            if (pthread_create(&ids[t], NULL, hogwild_worker, &jobs[t]) != 0) {
+                fprintf(stderr, "pthread_create failed\n");
+                return EXIT_FAILURE;
+            }
+        }
+        for (size_t t = 0; t < threads; t++) {
+            pthread_join(ids[t], NULL);
+        }
+        double hogwild_time = now() - start;
+
+        double sync_loss, hogwild_loss;
+        double sync_accuracy = evaluate(sync, test_images, test_labels, C, &sync_loss);
+        double hogwild_accuracy = evaluate(hogwild, test_images, test_labels, C, &hogwild_loss);
+
+        printf("%5zu | %10.0f %8.4f %8.2f%% | %10.0f %8.4f %8.2f%%\n", e+1,
+               N / sync_time, sync_loss, sync_accuracy,
+               N / hogwild_time, hogwild_loss, hogwild_accuracy);
+    }
+
+    for (size_t t = 0; t < threads; t++) {
+        net_free(jobs[t].n); // Leaves the borrowed parameters alone
+    }
+    net_free(sync);
+    net_free(hogwild);
+    mat_free(labels);
+    mat_free(images);
+    mat_free(test_labels);
+    mat_free(test_images);
+
+    return 0;
+}
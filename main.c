@@ -1,6 +1,10 @@
 #include "ml.h"
 #include "raylib.h"
 
+#ifdef STATIC_MODEL
+Inference model_inference(void); // Defined in the file generated by export
+#endif
+
 // These functions are just copied from train.c - Make a header file instead
 int swap_endian(int x)
 {
@@ -132,15 +136,13 @@ Mat downscale(Mat m)
     return d;
 }
 
-void classify_drawing(Network n, Mat image)
+void classify_drawing(Inference e, Mat image)
 {
     Mat input = downscale(image);
-    mat_flatten(&input);
-    mat_copy(NET_IN(n), input);
-    net_forward(n);
+    Mat out = inf_forward(e, mat_reshape(input, 28*28, 1));
 
     double confidence = 0.0;
-    int guess = mat_to_label(NET_OUT(n), &confidence);
+    int guess = mat_to_label(out, &confidence);
 
     printf("The neural network guessed: %d, with a confidence of %.2f percent.\n", guess, confidence * 100.0);
 
@@ -153,13 +155,23 @@ int main()
     const size_t HEIGHT = 280;
 
 
+#ifdef STATIC_MODEL
+    // The packed parameters are compiled in, see export.c
+    Inference e = model_inference();
+#else
     // Initialize the network
     size_t arch[] = { 28*28, 1000, 100, 10 };
     Network n = net_alloc(sizeof(arch)/sizeof(size_t), arch);
+    n.head = HEAD_SOFTMAX; // net_load checks it against the head train saved
 
     // Load the weights and biases
     net_load(n, "weights_and_biases");
 
+    // Repack the parameters for single image inference, the network itself is no longer needed
+    Inference e = inf_alloc(n);
+    net_free(n);
+#endif
+
     Mat frame = mat_alloc(WIDTH, HEIGHT);
 
 
@@ -202,7 +214,7 @@ int main()
 
             UnloadImage(image);
 
-            classify_drawing(n, frame);
+            classify_drawing(e, frame);
         }
 
 
@@ -215,7 +227,9 @@ int main()
     UnloadRenderTexture(target);
     CloseWindow();
 
-    net_free(n);
+#ifndef STATIC_MODEL
+    inf_free(e);
+#endif
     mat_free(frame);
 
     return 0;
@@ -3,38 +3,59 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
 #include <time.h>
+#include <float.h>
+#include <pthread.h>
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
 
 
 double sigmoid(double x);
+double now(void); // Wall clock time in seconds, for timing
 
 
-#define MAT_AT(m, i, j) m.data[m.cols * (i) + (j)]
+#define MAT_AT(m, i, j) m.data[m.stride * (i) + (j)]
 
 // Matrix conflicted with a type in raylib, so I had to change the name
 typedef struct Mat
 {
     size_t rows, cols;
+    size_t stride; // Distance between the starts of two rows in data
     double *data;
+    int owner; // Views borrow their data from another matrix or buffer, and mat_free leaves it alone
 } Mat;
 
 Mat mat_alloc(size_t rows, size_t cols);
+Mat mat_cols(Mat m, size_t col, size_t cols); // View of a range of columns, like a part of a batch
+int mat_contiguous(Mat m);
 void mat_copy(Mat dst, Mat src);
 void mat_fill(Mat m, double x);
 void mat_flatten(Mat *m);
 void mat_hadamard(Mat dst, Mat a, Mat b);
 Mat mat_transpose(Mat m);
 void mat_rand(Mat m, double min, double max);
+Mat mat_reshape(Mat m, size_t rows, size_t cols); // View of a contiguous matrix with a new shape
+Mat mat_rows(Mat m, size_t row, size_t rows); // View of a range of rows
 void mat_scale(Mat m, double x);
 void mat_sigmoid(Mat m);
+Mat mat_slice(Mat m, size_t row, size_t col, size_t rows, size_t cols); // View of a sub-matrix
 void mat_sub(Mat dst, Mat m);
 Mat mat_sub_from_f(double x, Mat m); // Allocates a new matrix with values x - m
 void mat_sum(Mat dst, Mat m);
 void mat_mult(Mat dst, Mat a, Mat b);
 void mat_print(Mat m);
 void mat_free(Mat m);
+Mat mat_view(double *data, size_t rows, size_t cols); // View of a contiguous buffer
+
+// These work on each column of m as a sample, so they take a single column vector or a batch
+size_t mat_count_correct(Mat m, Mat target); // Columns where the largest values are in the same row
+void mat_softmax(Mat m);
+double mat_softmax_xent(Mat m, Mat target, Mat deltas); // Logits in m become probabilities, returns the summed loss
+double mat_xent(Mat m, Mat target); // Summed cross-entropy of probabilities
 
 typedef struct Gradient
 {
@@ -43,9 +64,17 @@ typedef struct Gradient
     Mat *ds; // Deltas
 } Gradient;
 
+// Activation and loss of the output layer
+typedef enum Head
+{
+    HEAD_SIGMOID, // Sigmoid with squared error
+    HEAD_SOFTMAX, // Softmax with cross-entropy
+} Head;
+
 typedef struct Network
 {
     size_t layer_count; // Should include the input layer
+    Head head; // HEAD_SIGMOID unless changed after net_alloc
     Mat *ws; // Weights
     Mat *bs; // Biases
     Mat *as; // Activations
@@ -53,22 +82,94 @@ typedef struct Network
 } Network;
 
 
+// Weight files start with a header of size_t values: NET_FILE_MAGIC, the head, the layer count and
+// the size of each layer. The weights and biases of each layer follow.
+#define NET_FILE_MAGIC 0x3157544e // "NTW1"
+
 #define NET_IN(n) n.as[0]
 #define NET_OUT(n) n.as[(n.layer_count - 1)]
 
 // The layers array should specify the number of neurons in each layer
 Network net_alloc(size_t layer_count, size_t layers[]);
+Network net_alloc_fused(size_t layer_count, size_t layers[]); // No weight or bias gradient, see net_backprop_fused
+Network net_alloc_workspace(Network n); // Own activations and gradient, but borrows the weights and biases of n
 void net_backprop(Network n, Mat target, double learning_rate);
+void net_backprop_deltas(Network n, double learning_rate); // Starts from the output deltas already in n.g.ds
+void net_backprop_fused(Network n, double learning_rate);
+void net_bind_input(Network n, Mat in); // The input layer borrows in until the next call
+size_t net_bytes(Network n); // Memory of the matrices n owns: parameters, activations and gradient
 void net_forward(Network n);
+void net_forward_logits(Network n); // Leaves the output layer without its activation
 void net_free(Network n);
-void net_load(Network n, char *filename);
+void net_load(Network n, char *filename); // Exits if the file was saved for another architecture or head
 double net_loss(Network n, Mat target);
+void net_output_deltas(Network n, Mat target);
+size_t net_param_count(Network n);
+void net_params_get(Network n, double *dst); // Weights and biases for each layer, in the same order as net_save
+void net_params_set(Network n, const double *src);
 void net_print(Network n);
+void net_prune(Network n, double density); // Zeroes the weight blocks with the smallest norms in each layer, see Sparse
 void net_save(Network n, char *filename);
 void net_train(Network n, Mat in, Mat target, double learning_rate);
 void net_zero_gradient(Network n);
 
 
+// Inference only network with the weights repacked for matrix-vector products.
+// Each panel of INF_PANEL output rows is interleaved column by column, so the
+// kernel streams the weights once and keeps INF_PANEL rows in flight.
+#define INF_PANEL 8
+
+// Block compressed sparse rows. A block is one column of a panel of INF_PANEL rows,
+// laid out like a column of the packed weights, and only blocks with a nonzero weight are stored.
+typedef struct Sparse
+{
+    size_t rows, cols;
+    size_t block_count;
+    size_t *starts; // First block of each panel, with one extra at the end
+    size_t *index; // Column of each block
+    double *blocks; // INF_PANEL weights for each block
+} Sparse;
+
+Sparse sparse_alloc(Mat m);
+void sparse_free(Sparse s);
+void sparse_gemv(double *y, Sparse s, const double *b, const double *x, int activate); // Same as inf_gemv
+void sparse_mult(Mat dst, Sparse a, Mat b); // Same as mat_mult
+
+typedef struct Inference
+{
+    size_t layer_count;
+    Head head;
+    size_t *sizes; // Neurons in each layer, including the input layer
+    const double **ws; // Packed weights, NULL when sparse is used
+    Sparse *sparse; // Block sparse weights, NULL when ws is used
+    const double **bs; // Biases, padded to a multiple of INF_PANEL
+    double **as; // Activations, padded to a multiple of INF_PANEL
+} Inference;
+
+Inference inf_alloc(Network n);
+Inference inf_alloc_sparse(Network n); // For pruned networks, see net_prune
+Mat inf_forward(Inference e, Mat in); // The returned matrix points into e and should not be freed
+void inf_free(Inference e);
+void inf_gemv(double *y, const double *w, const double *b, const double *x, size_t rows, size_t cols, int activate);
+
+
+// Kernel settings that depend on the machine, found by autotune and read with ml_tuning_load.
+// Only mat_mult has any, the inference kernels don't.
+#define ML_MAX_THREADS 64
+
+typedef struct Tuning
+{
+    size_t block; // Tile size of mat_mult
+    size_t threads; // Threads used by mat_mult, including the caller
+    size_t parallel_min; // Multiply-adds before mat_mult uses more than one thread
+} Tuning;
+
+extern Tuning ml_tuning;
+
+void ml_cpu_model(char *model, size_t size);
+int ml_tuning_load(char *filename, size_t batch); // Returns 1 if the file has settings for this CPU and batch size, the defaults are kept otherwise
+
+
 #endif // Ml_H_
 
 #ifndef ML_IMPLEMENTATION
@@ -79,6 +180,20 @@ double sigmoid(double x)
     return 1.0 / (1.0 + exp(-x));
 }
 
+double now(void)
+{
+    struct timespec t;
+    // clock_gettime is POSIX, so -std=c11 hides it unless _DEFAULT_SOURCE is defined
+#ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &t);
+#else
+    timespec_get(&t, TIME_UTC);
+#endif
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+Tuning ml_tuning = { .block = 64, .threads = 1, .parallel_min = 1000000 };
+
 
 // Try to optimise some of these
 
@@ -86,10 +201,21 @@ Mat mat_alloc(size_t rows, size_t cols)
 {
     double *data = (double *) calloc(rows * cols, sizeof(double));
     assert(data != NULL);
-    Mat m = { .rows = rows, .cols = cols, .data = data };
+    Mat m = { .rows = rows, .cols = cols, .stride = cols, .data = data, .owner = 1 };
     return m;
 }
 
+Mat mat_cols(Mat m, size_t col, size_t cols)
+{
+    return mat_slice(m, 0, col, m.rows, cols);
+}
+
+// Whether the rows follow each other in memory without gaps
+int mat_contiguous(Mat m)
+{
+    return m.stride == m.cols || m.rows <= 1;
+}
+
 void mat_copy(Mat dst, Mat src)
 {
     assert(dst.rows == src.rows);
@@ -113,8 +239,11 @@ void mat_fill(Mat m, double x)
 
 void mat_flatten(Mat *m)
 {
+    assert(mat_contiguous(*m));
+
     m->rows = m->rows * m->cols;
     m->cols = 1;
+    m->stride = 1;
 }
 
 void mat_hadamard(Mat dst, Mat a, Mat b)
@@ -155,6 +284,19 @@ void mat_rand(Mat m, double min, double max)
     }
 }
 
+Mat mat_reshape(Mat m, size_t rows, size_t cols)
+{
+    assert(mat_contiguous(m));
+    assert(rows * cols == m.rows * m.cols);
+
+    return mat_view(m.data, rows, cols);
+}
+
+Mat mat_rows(Mat m, size_t row, size_t rows)
+{
+    return mat_slice(m, row, 0, rows, m.cols);
+}
+
 void mat_scale(Mat m, double x)
 {
     for (size_t i = 0; i < m.rows; i++) {
@@ -166,11 +308,22 @@ void mat_scale(Mat m, double x)
 
 void mat_sigmoid(Mat m)
 {
-    for (size_t i = 0; i < m.rows * m.cols; i++) {
-        m.data[i] = sigmoid(m.data[i]);
+    for (size_t i = 0; i < m.rows; i++) {
+        for (size_t j = 0; j < m.cols; j++) {
+            MAT_AT(m, i, j) = sigmoid(MAT_AT(m, i, j));
+        }
     }
 }
 
+Mat mat_slice(Mat m, size_t row, size_t col, size_t rows, size_t cols)
+{
+    assert(row + rows <= m.rows);
+    assert(col + cols <= m.cols);
+
+    Mat v = { .rows = rows, .cols = cols, .stride = m.stride, .data = &MAT_AT(m, row, col), .owner = 0 };
+    return v;
+}
+
 void mat_sub(Mat dst, Mat m)
 {
     assert(dst.rows == m.rows);
@@ -208,19 +361,91 @@ void mat_sum(Mat dst, Mat m)
     }
 }
 
-// Try to parallelise this?
+typedef struct MultJob
+{
+    Mat dst, a, b;
+    size_t first, last; // Rows of a
+} MultJob;
+
+// Rows first to last of dst = a * b, in tiles of ml_tuning.block.
+// The sum for each element is still taken in order of k, so the result does not depend on the tiling.
+static void mat_mult_rows(Mat dst, Mat a, Mat b, size_t first, size_t last)
+{
+    // Matrix-vector products are plain dot products, which keeps the sums in registers
+    if (b.cols == 1) {
+        for (size_t i = first; i < last; i++) {
+            double sum = 0.0;
+            for (size_t k = 0; k < a.cols; k++) {
+                sum += MAT_AT(a, i, k) * MAT_AT(b, k, 0);
+            }
+            MAT_AT(dst, i, 0) = sum;
+        }
+        return;
+    }
+
+    size_t block = ml_tuning.block;
+    for (size_t i = first; i < last; i++) {
+        for (size_t j = 0; j < b.cols; j++) {
+            MAT_AT(dst, i, j) = 0.0;
+        }
+    }
+
+    for (size_t i0 = first; i0 < last; i0 += block) {
+        for (size_t k0 = 0; k0 < a.cols; k0 += block) {
+            for (size_t j0 = 0; j0 < b.cols; j0 += block) {
+                size_t width = (j0 + block < b.cols ? j0 + block : b.cols) - j0;
+                for (size_t i = i0; i < i0 + block && i < last; i++) {
+                    double *restrict d = &MAT_AT(dst, i, j0);
+                    for (size_t k = k0; k < k0 + block && k < a.cols; k++) {
+                        double x = MAT_AT(a, i, k);
+                        const double *restrict row = &MAT_AT(b, k, j0);
+                        for (size_t j = 0; j < width; j++) {
+                            d[j] += x * row[j];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void *mat_mult_worker(void *arg)
+{
+    MultJob *job = arg;
+    mat_mult_rows(job->dst, job->a, job->b, job->first, job->last);
+    return NULL;
+}
+
+// dst must not overlap a or b
 void mat_mult(Mat dst, Mat a, Mat b)
 {
     assert(a.cols == b.rows);
     assert(dst.rows == a.rows);
     assert(dst.cols == b.cols);
 
-    for (size_t i = 0; i < a.rows; i++) {
-        for (size_t j = 0; j < b.cols; j++) {
-            MAT_AT(dst, i, j) = 0.0;
-            for (size_t k = 0; k < a.cols; k++) {
-                MAT_AT(dst, i, j) += MAT_AT(a, i, k) * MAT_AT(b, k, j);
-            }
+    size_t threads = ml_tuning.threads < a.rows ? ml_tuning.threads : a.rows;
+    if (threads <= 1 || a.rows * a.cols * b.cols < ml_tuning.parallel_min) {
+        mat_mult_rows(dst, a, b, 0, a.rows);
+        return;
+    }
+
+    // The rows of a are split between the threads, and the caller takes the first share
+    MultJob jobs[ML_MAX_THREADS];
+    pthread_t ids[ML_MAX_THREADS];
+    int started[ML_MAX_THREADS] = { 0 };
+    for (size_t t = 0; t < threads; t++) {
+        jobs[t] = (MultJob) { dst, a, b, t * a.rows / threads, (t + 1) * a.rows / threads };
+    }
+    for (size_t t = 1; t < threads; t++) {
+        started[t] = pthread_create(&ids[t], NULL, mat_mult_worker, &jobs[t]) == 0;
+    }
+
+    mat_mult_worker(&jobs[0]);
+    for (size_t t = 1; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(ids[t], NULL);
+        } else {
+            mat_mult_worker(&jobs[t]); // Do the share here if the thread could not be created
         }
     }
 }
@@ -238,15 +463,125 @@ void mat_print(Mat m)
 
 void mat_free(Mat m)
 {
-    free(m.data);
+    if (m.owner) {
+        free(m.data);
+    }
 }
 
+Mat mat_view(double *data, size_t rows, size_t cols)
+{
+    Mat v = { .rows = rows, .cols = cols, .stride = cols, .data = data, .owner = 0 };
+    return v;
+}
 
+size_t mat_count_correct(Mat m, Mat target)
+{
+    assert(m.rows == target.rows);
+    assert(m.cols == target.cols);
+
+    size_t correct = 0;
+    for (size_t j = 0; j < m.cols; j++) {
+        size_t guess = 0;
+        size_t answer = 0;
+        for (size_t i = 1; i < m.rows; i++) {
+            if (MAT_AT(m, i, j) > MAT_AT(m, guess, j)) {
+                guess = i;
+            }
+            if (MAT_AT(target, i, j) > MAT_AT(target, answer, j)) {
+                answer = i;
+            }
+        }
+        correct += guess == answer;
+    }
 
-Network net_alloc(size_t layer_count, size_t layers[])
+    return correct;
+}
+
+// The largest value is subtracted before exp so it can't overflow
+void mat_softmax(Mat m)
+{
+    for (size_t j = 0; j < m.cols; j++) {
+        double max = MAT_AT(m, 0, j);
+        for (size_t i = 1; i < m.rows; i++) {
+            if (MAT_AT(m, i, j) > max) {
+                max = MAT_AT(m, i, j);
+            }
+        }
+
+        double sum = 0.0;
+        for (size_t i = 0; i < m.rows; i++) {
+            MAT_AT(m, i, j) = exp(MAT_AT(m, i, j) - max);
+            sum += MAT_AT(m, i, j);
+        }
+
+        for (size_t i = 0; i < m.rows; i++) {
+            MAT_AT(m, i, j) /= sum;
+        }
+    }
+}
+
+// Softmax, cross-entropy and its gradient in one go.
+// The loss is computed from the logits with log-sum-exp instead of taking the log of
+// probabilities that may have rounded to zero, and the gradient is p - t.
+double mat_softmax_xent(Mat m, Mat target, Mat deltas)
+{
+    assert(m.rows == target.rows && m.rows == deltas.rows);
+    assert(m.cols == target.cols && m.cols == deltas.cols);
+
+    double loss = 0.0;
+    for (size_t j = 0; j < m.cols; j++) {
+        double max = MAT_AT(m, 0, j);
+        for (size_t i = 1; i < m.rows; i++) {
+            if (MAT_AT(m, i, j) > max) {
+                max = MAT_AT(m, i, j);
+            }
+        }
+
+        // exp(z - max) is kept in the deltas until the sum is known
+        double sum = 0.0;
+        for (size_t i = 0; i < m.rows; i++) {
+            MAT_AT(deltas, i, j) = exp(MAT_AT(m, i, j) - max);
+            sum += MAT_AT(deltas, i, j);
+        }
+        double lse = max + log(sum);
+
+        for (size_t i = 0; i < m.rows; i++) {
+            double t = MAT_AT(target, i, j);
+            double p = MAT_AT(deltas, i, j) / sum;
+            loss += t * (lse - MAT_AT(m, i, j));
+            MAT_AT(m, i, j) = p;
+            MAT_AT(deltas, i, j) = p - t;
+        }
+    }
+
+    return loss;
+}
+
+// For evaluating probabilities that are already computed. Zeros are clamped to DBL_MIN.
+double mat_xent(Mat m, Mat target)
+{
+    assert(m.rows == target.rows);
+    assert(m.cols == target.cols);
+
+    double loss = 0.0;
+    for (size_t i = 0; i < m.rows; i++) {
+        for (size_t j = 0; j < m.cols; j++) {
+            double p = MAT_AT(m, i, j) > DBL_MIN ? MAT_AT(m, i, j) : DBL_MIN;
+            loss -= MAT_AT(target, i, j) * log(p);
+        }
+    }
+
+    return loss;
+}
+
+
+
+// Shared by net_alloc and net_alloc_fused
+static Network net_alloc_layers(size_t layer_count, size_t layers[], int weight_gradient)
 {
     Network n;
     n.layer_count = layer_count;
+    n.head = HEAD_SIGMOID;
 
     // Allocate arrays for parameters
     n.ws = (Mat *) malloc(sizeof(*n.ws) * (n.layer_count - 1));
@@ -255,13 +590,18 @@ Network net_alloc(size_t layer_count, size_t layers[])
     assert(n.ws != NULL && n.bs != NULL && n.as != NULL);
 
     // Allocate arrays for the gradient
-    n.g.ws = (Mat *) malloc(sizeof(*n.g.ws) * (n.layer_count - 1));
-    n.g.bs = (Mat *) malloc(sizeof(*n.g.bs) * (n.layer_count - 1));
+    n.g.ws = NULL;
+    n.g.bs = NULL;
+    if (weight_gradient) {
+        n.g.ws = (Mat *) malloc(sizeof(*n.g.ws) * (n.layer_count - 1));
+        n.g.bs = (Mat *) malloc(sizeof(*n.g.bs) * (n.layer_count - 1));
+        assert(n.g.ws != NULL && n.g.bs != NULL);
+    }
     n.g.ds = (Mat *) malloc(sizeof(*n.g.ds) * n.layer_count);
-    assert(n.g.ws != NULL && n.g.bs != NULL && n.g.ds != NULL);
+    assert(n.g.ds != NULL);
 
     // Allocate and initialize architecture
-    n.as[0] = mat_alloc(layers[0], 1); // Stick with flattened data for now
+    n.as[0] = mat_view(NULL, layers[0], 1); // Nothing is bound until net_bind_input
     n.g.ds[0] = mat_alloc(layers[0], 1); // Stick with flattened data for now
     for (size_t i = 1; i < n.layer_count; i++) {
         n.ws[i-1] = mat_alloc(layers[i], layers[i-1]);
@@ -271,36 +611,90 @@ Network net_alloc(size_t layer_count, size_t layers[])
         mat_rand(n.ws[i-1], -1.0, 1.0);
         mat_rand(n.bs[i-1], -1.0, 1.0);
 
-        n.g.ws[i-1] = mat_alloc(layers[i], layers[i-1]);
-        n.g.bs[i-1] = mat_alloc(layers[i], 1);
+        if (weight_gradient) {
+            n.g.ws[i-1] = mat_alloc(layers[i], layers[i-1]);
+            n.g.bs[i-1] = mat_alloc(layers[i], 1);
+        }
         n.g.ds[i] = mat_alloc(layers[i], 1);
     }
 
     return n;
 }
 
-// Check the wikipedia page for backpropagation for further explanation
-void net_backprop(Network n, Mat target, double learning_rate)
+Network net_alloc(size_t layer_count, size_t layers[])
 {
-    // Remember that the first matrix in n.as and g.ds is the input layer
-    // This should probably be removed for g.ds, but we will do that later.
-    // This means the current activation matrix at an index is as[i+1], not as[i].
+    return net_alloc_layers(layer_count, layers, 1);
+}
 
-    Mat o = NET_OUT(n);
+Network net_alloc_fused(size_t layer_count, size_t layers[])
+{
+    return net_alloc_layers(layer_count, layers, 0);
+}
+
+Network net_alloc_workspace(Network n)
+{
+    Network w;
+    w.layer_count = n.layer_count;
+    w.head = n.head;
+
+    // Views of the parameters of n, so net_free only frees the arrays
+    w.ws = (Mat *) malloc(sizeof(*w.ws) * (w.layer_count - 1));
+    w.bs = (Mat *) malloc(sizeof(*w.bs) * (w.layer_count - 1));
+    assert(w.ws != NULL && w.bs != NULL);
+    for (size_t i = 0; i < w.layer_count - 1; i++) {
+        w.ws[i] = mat_slice(n.ws[i], 0, 0, n.ws[i].rows, n.ws[i].cols);
+        w.bs[i] = mat_slice(n.bs[i], 0, 0, n.bs[i].rows, n.bs[i].cols);
+    }
 
+    // Only allocate a weight gradient if n has one
+    w.g.ws = NULL;
+    w.g.bs = NULL;
+    if (n.g.ws != NULL) {
+        w.g.ws = (Mat *) malloc(sizeof(*w.g.ws) * (w.layer_count - 1));
+        w.g.bs = (Mat *) malloc(sizeof(*w.g.bs) * (w.layer_count - 1));
+        assert(w.g.ws != NULL && w.g.bs != NULL);
+    }
+    w.as = (Mat *) malloc(sizeof(*w.as) * w.layer_count);
+    w.g.ds = (Mat *) malloc(sizeof(*w.g.ds) * w.layer_count);
+    assert(w.as != NULL && w.g.ds != NULL);
+
+    w.as[0] = mat_view(NULL, n.as[0].rows, n.as[0].cols);
+    w.g.ds[0] = mat_alloc(n.g.ds[0].rows, n.g.ds[0].cols);
+    for (size_t i = 1; i < w.layer_count; i++) {
+        w.as[i] = mat_alloc(n.as[i].rows, n.as[i].cols);
+        if (w.g.ws != NULL) {
+            w.g.ws[i-1] = mat_alloc(n.ws[i-1].rows, n.ws[i-1].cols);
+            w.g.bs[i-1] = mat_alloc(n.bs[i-1].rows, n.bs[i-1].cols);
+        }
+        w.g.ds[i] = mat_alloc(n.as[i].rows, n.as[i].cols);
+    }
+
+    return w;
+}
+
+// Check the wikipedia page for backpropagation for further explanation
+void net_backprop(Network n, Mat target, double learning_rate)
+{
     // Zero out the gradient
     net_zero_gradient(n);
 
     // Calculate the deltas for the output neurons first
-    // delta = (o_j - t_j) * o_j * (1 - o_j)
-    Mat deltas = n.g.ds[n.layer_count - 1];
-    Mat one_minus_o = mat_sub_from_f(1, o);
+    net_output_deltas(n, target);
 
-    mat_copy(deltas, o);
-    mat_sub(deltas, target);
-    mat_hadamard(deltas, deltas, o);
-    mat_hadamard(deltas, deltas, one_minus_o);
-    mat_free(one_minus_o);
+    net_backprop_deltas(n, learning_rate);
+}
+
+void net_backprop_deltas(Network n, double learning_rate)
+{
+    // Remember that the first matrix in n.as and g.ds is the input layer
+    // This should probably be removed for g.ds, but we will do that later.
+    // This means the current activation matrix at an index is as[i+1], not as[i].
+
+    // Networks without a weight gradient update their parameters in place
+    if (n.g.ws == NULL) {
+        net_backprop_fused(n, learning_rate);
+        return;
+    }
 
     // Gradient for the weights in the output layer
     Mat at = mat_transpose(n.as[n.layer_count - 2]);
@@ -319,7 +713,7 @@ void net_backprop(Network n, Mat target, double learning_rate)
         Mat one_minus_o = mat_sub_from_f(1, n.as[i+1]);
 
         Mat delta_next = n.g.ds[i+2]; // Delta from next layer
-        deltas = n.g.ds[i+1];
+        Mat deltas = n.g.ds[i+1];
 
         mat_mult(deltas, wt, delta_next);
         mat_hadamard(deltas, deltas, n.as[i+1]);
@@ -346,12 +740,100 @@ void net_backprop(Network n, Mat target, double learning_rate)
     }
 }
 
+// Plain SGD without a weight gradient. Each layer makes a single pass over its weights, where
+// every row is first used for the deltas of the layer below and then updated with
+// W -= learning_rate * delta * a^T, so the deltas still see the old weights like in net_backprop.
+void net_backprop_fused(Network n, double learning_rate)
+{
+    for (size_t i = n.layer_count - 1; i > 0; i--) {
+        Mat w = n.ws[i-1];
+        Mat b = n.bs[i-1];
+        Mat a = n.as[i-1];
+        Mat d = n.g.ds[i];
+        Mat prev = n.g.ds[i-1];
+        int below = i > 1; // No deltas are needed for the input layer
+
+        if (below) {
+            mat_fill(prev, 0.0);
+        }
+
+        for (size_t j = 0; j < w.rows; j++) {
+            double dj = MAT_AT(d, j, 0);
+            double step = learning_rate * dj;
+            double *wj = &MAT_AT(w, j, 0);
+
+            if (below) {
+                for (size_t k = 0; k < w.cols; k++) {
+                    MAT_AT(prev, k, 0) += wj[k] * dj;
+                    wj[k] -= step * MAT_AT(a, k, 0);
+                }
+            } else {
+                for (size_t k = 0; k < w.cols; k++) {
+                    wj[k] -= step * MAT_AT(a, k, 0);
+                }
+            }
+            MAT_AT(b, j, 0) -= step;
+        }
+
+        // delta = sum_l_in_L(w_jl * delta_l) * o_j * (1 - o_j)
+        if (below) {
+            for (size_t k = 0; k < prev.rows; k++) {
+                double ak = MAT_AT(a, k, 0);
+                MAT_AT(prev, k, 0) *= ak * (1.0 - ak);
+            }
+        }
+    }
+}
+
+void net_bind_input(Network n, Mat in)
+{
+    assert(NET_IN(n).rows == in.rows);
+    assert(NET_IN(n).cols == in.cols);
+
+    NET_IN(n) = mat_slice(in, 0, 0, in.rows, in.cols);
+}
+
+static size_t mat_bytes(Mat m)
+{
+    return m.owner ? m.rows * m.cols * sizeof(double) : 0;
+}
+
+// Views, like the borrowed parameters of a workspace, are not counted
+size_t net_bytes(Network n)
+{
+    size_t bytes = mat_bytes(n.as[0]) + mat_bytes(n.g.ds[0]);
+    for (size_t i = 1; i < n.layer_count; i++) {
+        bytes += mat_bytes(n.ws[i-1]) + mat_bytes(n.bs[i-1]);
+        bytes += mat_bytes(n.as[i]) + mat_bytes(n.g.ds[i]);
+        if (n.g.ws != NULL) {
+            bytes += mat_bytes(n.g.ws[i-1]) + mat_bytes(n.g.bs[i-1]);
+        }
+    }
+
+    return bytes;
+}
+
 void net_forward(Network n)
 {
+    net_forward_logits(n);
+
+    if (n.head == HEAD_SOFTMAX) {
+        mat_softmax(NET_OUT(n));
+    } else {
+        mat_sigmoid(NET_OUT(n));
+    }
+}
+
+void net_forward_logits(Network n)
+{
+    assert(NET_IN(n).data != NULL);
+
     for (size_t i = 0; i < n.layer_count - 1; i++) {
         mat_mult(n.as[i+1], n.ws[i], n.as[i]);
         mat_sum(n.as[i+1], n.bs[i]);
-        mat_sigmoid(n.as[i+1]);
+        if (i + 1 < n.layer_count - 1) {
+            mat_sigmoid(n.as[i+1]);
+        }
     }
 }
 
@@ -364,8 +846,10 @@ void net_free(Network n)
         mat_free(n.bs[i-1]);
         mat_free(n.as[i]);
 
-        mat_free(n.g.ws[i-1]);
-        mat_free(n.g.bs[i-1]);
+        if (n.g.ws != NULL) {
+            mat_free(n.g.ws[i-1]);
+            mat_free(n.g.bs[i-1]);
+        }
         mat_free(n.g.ds[i]);
     }
 
@@ -378,6 +862,24 @@ void net_free(Network n)
     free(n.g.ds);
 }
 
+// The header of a weight file for n, see NET_FILE_MAGIC
+static size_t *net_file_header(Network n, size_t *count)
+{
+    *count = 3 + n.layer_count;
+    size_t *header = (size_t *) malloc(sizeof(size_t) * *count);
+    assert(header != NULL);
+
+    header[0] = NET_FILE_MAGIC;
+    header[1] = n.head;
+    header[2] = n.layer_count;
+    header[3] = n.ws[0].cols;
+    for (size_t i = 1; i < n.layer_count; i++) {
+        header[3+i] = n.ws[i-1].rows;
+    }
+
+    return header;
+}
+
 void net_load(Network n, char *filename)
 {
     FILE *f = fopen(filename, "rb");
@@ -386,7 +888,23 @@ void net_load(Network n, char *filename)
         exit(EXIT_FAILURE);
     }
 
-    size_t read = 0;
+    // Otherwise the weights of another network, or of a sigmoid trained one, would load without complaint
+    size_t count = 0;
+    size_t *expected = net_file_header(n, &count);
+    size_t *header = (size_t *) calloc(count, sizeof(size_t));
+    assert(header != NULL);
+    size_t read = fread(header, sizeof(size_t), count, f);
+    if (read == 0 || header[0] != NET_FILE_MAGIC) {
+        fprintf(stderr, "%s has no header, it was saved by an older version and has to be trained again\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    if (read != count || memcmp(header, expected, sizeof(size_t) * count) != 0) {
+        fprintf(stderr, "%s was saved with a different architecture or head\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    free(header);
+    free(expected);
+
     for (size_t i = 0; i < n.layer_count - 1; i++) {
         read = fread(n.ws[i].data, sizeof(double), n.ws[i].rows * n.ws[i].cols, f);
         read += fread(n.bs[i].data, sizeof(double), n.bs[i].rows * n.bs[i].cols, f);
@@ -404,16 +922,126 @@ double net_loss(Network n, Mat target)
     assert(NET_OUT(n).rows == target.rows);
     assert(NET_OUT(n).cols == target.cols);
 
+    // Cross-entropy, with the output deltas as scratch space
+    if (n.head == HEAD_SOFTMAX) {
+        net_forward_logits(n);
+        return mat_softmax_xent(NET_OUT(n), target, n.g.ds[n.layer_count - 1]);
+    }
+
     net_forward(n);
 
     double l = 0;
     for (size_t i = 0; i < NET_OUT(n).rows; i++) {
-        l += pow((MAT_AT(NET_OUT(n), i, 0)) - MAT_AT(target, i, 0), 2);
+        double d = MAT_AT(NET_OUT(n), i, 0) - MAT_AT(target, i, 0);
+        l += d * d;
     }
 
     return l / NET_OUT(n).rows;
 }
 
+void net_output_deltas(Network n, Mat target)
+{
+    Mat o = NET_OUT(n);
+    Mat deltas = n.g.ds[n.layer_count - 1];
+    assert(o.rows == target.rows);
+
+    for (size_t j = 0; j < o.rows; j++) {
+        double oj = MAT_AT(o, j, 0);
+        double tj = MAT_AT(target, j, 0);
+        if (n.head == HEAD_SOFTMAX) {
+            // delta = o_j - t_j, as the softmax derivative cancels against the cross-entropy
+            MAT_AT(deltas, j, 0) = oj - tj;
+        } else {
+            // delta = (o_j - t_j) * o_j * (1 - o_j)
+            MAT_AT(deltas, j, 0) = (oj - tj) * oj * (1.0 - oj);
+        }
+    }
+}
+
+size_t net_param_count(Network n)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n.layer_count - 1; i++) {
+        count += n.ws[i].rows * n.ws[i].cols + n.bs[i].rows * n.bs[i].cols;
+    }
+
+    return count;
+}
+
+void net_params_get(Network n, double *dst)
+{
+    for (size_t i = 0; i < n.layer_count - 1; i++) {
+        size_t w = n.ws[i].rows * n.ws[i].cols;
+        size_t b = n.bs[i].rows * n.bs[i].cols;
+        memcpy(dst, n.ws[i].data, w * sizeof(double));
+        memcpy(dst + w, n.bs[i].data, b * sizeof(double));
+        dst += w + b;
+    }
+}
+
+void net_params_set(Network n, const double *src)
+{
+    for (size_t i = 0; i < n.layer_count - 1; i++) {
+        size_t w = n.ws[i].rows * n.ws[i].cols;
+        size_t b = n.bs[i].rows * n.bs[i].cols;
+        memcpy(n.ws[i].data, src, w * sizeof(double));
+        memcpy(n.bs[i].data, src + w, b * sizeof(double));
+        src += w + b;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// One-shot magnitude pruning in blocks of the same shape as Sparse, so the pruned blocks can be skipped.
+// Keeps about density of the blocks in each layer, ranked by their squared norm.
+void net_prune(Network n, double density)
+{
+    assert(density >= 0.0 && density <= 1.0);
+
+    for (size_t i = 0; i < n.layer_count - 1; i++) {
+        Mat w = n.ws[i];
+        size_t panels = (w.rows + INF_PANEL - 1) / INF_PANEL;
+        size_t count = panels * w.cols;
+
+        double *norms = (double *) malloc(sizeof(double) * count);
+        double *sorted = (double *) malloc(sizeof(double) * count);
+        assert(norms != NULL && sorted != NULL);
+
+        for (size_t p = 0; p < panels; p++) {
+            for (size_t k = 0; k < w.cols; k++) {
+                double norm = 0.0;
+                for (size_t r = p * INF_PANEL; r < (p + 1) * INF_PANEL && r < w.rows; r++) {
+                    norm += MAT_AT(w, r, k) * MAT_AT(w, r, k);
+                }
+                norms[p * w.cols + k] = norm;
+            }
+        }
+
+        memcpy(sorted, norms, sizeof(double) * count);
+        qsort(sorted, count, sizeof(double), compare_doubles);
+        size_t keep = (size_t) ceil(density * (double) count);
+        double threshold = keep == 0 ? INFINITY : sorted[count - keep];
+
+        for (size_t p = 0; p < panels; p++) {
+            for (size_t k = 0; k < w.cols; k++) {
+                if (norms[p * w.cols + k] < threshold) {
+                    for (size_t r = p * INF_PANEL; r < (p + 1) * INF_PANEL && r < w.rows; r++) {
+                        MAT_AT(w, r, k) = 0.0;
+                    }
+                }
+            }
+        }
+
+        free(norms);
+        free(sorted);
+    }
+}
+
 // For debugging
 void net_print(Network n)
 {
@@ -443,8 +1071,16 @@ void net_save(Network n, char *filename)
         exit(EXIT_FAILURE);
     }
 
+    size_t count = 0;
+    size_t *header = net_file_header(n, &count);
+    size_t written = fwrite(header, sizeof(size_t), count, f);
+    free(header);
+    if (written != count) {
+        perror("fwrite failed while saving network");
+        exit(EXIT_FAILURE);
+    }
+
     // Store the weights and biases consecutively for each layer
-    size_t written = 0;
     for (size_t i = 0; i < n.layer_count - 1; i++) {
         written = fwrite(n.ws[i].data, sizeof(double), n.ws[i].rows * n.ws[i].cols, f);
         written += fwrite(n.bs[i].data, sizeof(double), n.bs[i].rows * n.bs[i].cols, f);
@@ -462,24 +1098,378 @@ void net_train(Network n, Mat in, Mat target, double learning_rate)
     assert(NET_IN(n).rows == in.rows);
     assert(NET_OUT(n).rows == target.rows);
 
-    // Set the input data
-    mat_copy(NET_IN(n), in);
-
-    // Forward pass
-    net_forward(n);
+    // Point the input layer at the data
+    net_bind_input(n, in);
+
+    // Forward pass and output deltas
+    if (n.head == HEAD_SOFTMAX) {
+        // Probabilities, loss and deltas in a single pass over the logits
+        net_forward_logits(n);
+        mat_softmax_xent(NET_OUT(n), target, n.g.ds[n.layer_count - 1]);
+    } else {
+        net_forward(n);
+        net_output_deltas(n, target);
+    }
 
     // Backprop
-    net_backprop(n, target, learning_rate);
+    net_backprop_deltas(n, learning_rate);
 }
 
 void net_zero_gradient(Network n)
 {
     for (size_t i = 0; i < n.layer_count - 1; i++) {
-        mat_fill(n.g.ws[i], 0.0);
-        mat_fill(n.g.bs[i], 0.0);
+        if (n.g.ws != NULL) {
+            mat_fill(n.g.ws[i], 0.0);
+            mat_fill(n.g.bs[i], 0.0);
+        }
         mat_fill(n.g.ds[i], 0.0);
     }
     mat_fill(n.g.ds[n.layer_count - 1], 0.0);
 }
 
+
+
+// Rows rounded up to a whole number of panels
+static size_t inf_padded(size_t rows)
+{
+    return (rows + INF_PANEL - 1) / INF_PANEL * INF_PANEL;
+}
+
+static Inference inf_alloc_weights(Network n, int sparse)
+{
+    Inference e;
+    e.layer_count = n.layer_count;
+    e.head = n.head;
+
+    e.sizes = (size_t *) malloc(sizeof(*e.sizes) * e.layer_count);
+    e.ws = sparse ? NULL : (const double **) malloc(sizeof(*e.ws) * (e.layer_count - 1));
+    e.sparse = sparse ? (Sparse *) malloc(sizeof(*e.sparse) * (e.layer_count - 1)) : NULL;
+    e.bs = (const double **) malloc(sizeof(*e.bs) * (e.layer_count - 1));
+    e.as = (double **) malloc(sizeof(*e.as) * e.layer_count);
+    assert(e.sizes != NULL && (e.ws != NULL || e.sparse != NULL) && e.bs != NULL && e.as != NULL);
+
+    e.sizes[0] = NET_IN(n).rows;
+    e.as[0] = NULL; // The input is read straight from the matrix passed to inf_forward
+    for (size_t i = 0; i < e.layer_count - 1; i++) {
+        Mat w = n.ws[i];
+        size_t padded = inf_padded(w.rows);
+        e.sizes[i+1] = w.rows;
+
+        // Padding rows are left as zero
+        double *bs = (double *) calloc(padded, sizeof(double));
+        double *as = (double *) calloc(padded, sizeof(double));
+        assert(bs != NULL && as != NULL);
+        for (size_t r = 0; r < w.rows; r++) {
+            bs[r] = MAT_AT(n.bs[i], r, 0);
+        }
+        e.bs[i] = bs;
+        e.as[i+1] = as;
+
+        if (sparse) {
+            e.sparse[i] = sparse_alloc(w);
+            continue;
+        }
+
+        double *ws = (double *) calloc(padded * w.cols, sizeof(double));
+        assert(ws != NULL);
+
+        // Weight (r, k) goes to panel r / INF_PANEL, column k, lane r % INF_PANEL
+        for (size_t r = 0; r < w.rows; r++) {
+            double *panel = ws + (r / INF_PANEL) * INF_PANEL * w.cols;
+            for (size_t k = 0; k < w.cols; k++) {
+                panel[k * INF_PANEL + r % INF_PANEL] = MAT_AT(w, r, k);
+            }
+        }
+        e.ws[i] = ws;
+    }
+
+    return e;
+}
+
+Inference inf_alloc(Network n)
+{
+    return inf_alloc_weights(n, 0);
+}
+
+Inference inf_alloc_sparse(Network n)
+{
+    return inf_alloc_weights(n, 1);
+}
+
+Mat inf_forward(Inference e, Mat in)
+{
+    assert(in.rows == e.sizes[0]);
+    assert(in.cols == 1);
+    assert(mat_contiguous(in));
+
+    const double *x = in.data;
+    for (size_t i = 0; i < e.layer_count - 1; i++) {
+        int hidden = i + 1 < e.layer_count - 1;
+        int activate = hidden || e.head == HEAD_SIGMOID;
+        if (e.sparse != NULL) {
+            sparse_gemv(e.as[i+1], e.sparse[i], e.bs[i], x, activate);
+        } else {
+            inf_gemv(e.as[i+1], e.ws[i], e.bs[i], x, e.sizes[i+1], e.sizes[i], activate);
+        }
+        x = e.as[i+1];
+    }
+
+    Mat out = mat_view(e.as[e.layer_count - 1], e.sizes[e.layer_count - 1], 1);
+    if (e.head == HEAD_SOFTMAX) {
+        mat_softmax(out);
+    }
+
+    return out;
+}
+
+void inf_free(Inference e)
+{
+    for (size_t i = 0; i < e.layer_count - 1; i++) {
+        if (e.sparse != NULL) {
+            sparse_free(e.sparse[i]);
+        } else {
+            free((void *) e.ws[i]);
+        }
+        free((void *) e.bs[i]);
+        free(e.as[i+1]);
+    }
+
+    free(e.sizes);
+    free(e.ws);
+    free(e.sparse);
+    free(e.bs);
+    free(e.as);
+}
+
+// y = sigmoid(w * x + b) for packed w, or just w * x + b without activate.
+// y and b must hold a whole number of panels.
+// Even and odd columns go to separate accumulators to break up the add chains.
+void inf_gemv(double *y, const double *w, const double *b, const double *x, size_t rows, size_t cols, int activate)
+{
+    for (size_t p = 0; p < rows; p += INF_PANEL) {
+        const double *panel = w + p * cols;
+        double acc0[INF_PANEL] = { 0 };
+        double acc1[INF_PANEL] = { 0 };
+
+        size_t k = 0;
+        for (; k + 1 < cols; k += 2) {
+            const double *w0 = panel + k * INF_PANEL;
+            const double *w1 = w0 + INF_PANEL;
+            for (size_t l = 0; l < INF_PANEL; l++) {
+                acc0[l] += w0[l] * x[k];
+                acc1[l] += w1[l] * x[k+1];
+            }
+        }
+        if (k < cols) {
+            const double *w0 = panel + k * INF_PANEL;
+            for (size_t l = 0; l < INF_PANEL; l++) {
+                acc0[l] += w0[l] * x[k];
+            }
+        }
+
+        for (size_t l = 0; l < INF_PANEL; l++) {
+            double z = acc0[l] + acc1[l] + b[p+l];
+            y[p+l] = activate ? sigmoid(z) : z;
+        }
+    }
+}
+
+
+
+// Blocks that are all zero are left out
+Sparse sparse_alloc(Mat m)
+{
+    Sparse s;
+    s.rows = m.rows;
+    s.cols = m.cols;
+
+    size_t panels = inf_padded(m.rows) / INF_PANEL;
+    s.starts = (size_t *) malloc(sizeof(*s.starts) * (panels + 1));
+    assert(s.starts != NULL);
+
+    // Count the blocks first, so they can be stored in one allocation
+    s.block_count = 0;
+    for (size_t p = 0; p < panels; p++) {
+        s.starts[p] = s.block_count;
+        for (size_t k = 0; k < m.cols; k++) {
+            for (size_t r = p * INF_PANEL; r < (p + 1) * INF_PANEL && r < m.rows; r++) {
+                if (MAT_AT(m, r, k) != 0.0) {
+                    s.block_count++;
+                    break;
+                }
+            }
+        }
+    }
+    s.starts[panels] = s.block_count;
+
+    // At least one block, since malloc(0) may return NULL
+    s.index = (size_t *) malloc(sizeof(*s.index) * (s.block_count + 1));
+    s.blocks = (double *) calloc((s.block_count + 1) * INF_PANEL, sizeof(double));
+    assert(s.index != NULL && s.blocks != NULL);
+
+    size_t j = 0;
+    for (size_t p = 0; p < panels; p++) {
+        for (size_t k = 0; k < m.cols; k++) {
+            int zero = 1;
+            for (size_t r = p * INF_PANEL; r < (p + 1) * INF_PANEL && r < m.rows; r++) {
+                s.blocks[j * INF_PANEL + r % INF_PANEL] = MAT_AT(m, r, k);
+                zero = zero && MAT_AT(m, r, k) == 0.0;
+            }
+            if (!zero) {
+                s.index[j++] = k;
+            }
+        }
+    }
+
+    return s;
+}
+
+void sparse_free(Sparse s)
+{
+    free(s.starts);
+    free(s.index);
+    free(s.blocks);
+}
+
+// y and b must hold a whole number of panels, like for inf_gemv
+void sparse_gemv(double *y, Sparse s, const double *b, const double *x, int activate)
+{
+    for (size_t p = 0; p < s.rows; p += INF_PANEL) {
+        size_t end = s.starts[p / INF_PANEL + 1];
+        double acc0[INF_PANEL] = { 0 };
+        double acc1[INF_PANEL] = { 0 };
+
+        size_t j = s.starts[p / INF_PANEL];
+        for (; j + 1 < end; j += 2) {
+            const double *w0 = s.blocks + j * INF_PANEL;
+            const double *w1 = w0 + INF_PANEL;
+            double x0 = x[s.index[j]];
+            double x1 = x[s.index[j+1]];
+            for (size_t l = 0; l < INF_PANEL; l++) {
+                acc0[l] += w0[l] * x0;
+                acc1[l] += w1[l] * x1;
+            }
+        }
+        if (j < end) {
+            const double *w0 = s.blocks + j * INF_PANEL;
+            double x0 = x[s.index[j]];
+            for (size_t l = 0; l < INF_PANEL; l++) {
+                acc0[l] += w0[l] * x0;
+            }
+        }
+
+        for (size_t l = 0; l < INF_PANEL; l++) {
+            double z = acc0[l] + acc1[l] + b[p+l];
+            y[p+l] = activate ? sigmoid(z) : z;
+        }
+    }
+}
+
+// Each block adds a scaled row of b to INF_PANEL rows of dst
+void sparse_mult(Mat dst, Sparse a, Mat b)
+{
+    assert(a.cols == b.rows);
+    assert(dst.rows == a.rows);
+    assert(dst.cols == b.cols);
+
+    mat_fill(dst, 0.0);
+    for (size_t p = 0; p < a.rows; p += INF_PANEL) {
+        for (size_t j = a.starts[p / INF_PANEL]; j < a.starts[p / INF_PANEL + 1]; j++) {
+            const double *w = a.blocks + j * INF_PANEL;
+            size_t k = a.index[j];
+            for (size_t l = 0; l < INF_PANEL && p + l < a.rows; l++) {
+                for (size_t c = 0; c < b.cols; c++) {
+                    MAT_AT(dst, p + l, c) += w[l] * MAT_AT(b, k, c);
+                }
+            }
+        }
+    }
+}
+
+
+
+
+// The model name from /proc/cpuinfo, or "unknown"
+void ml_cpu_model(char *model, size_t size)
+{
+    snprintf(model, size, "unknown");
+
+#ifdef __APPLE__
+    size_t length = size;
+    if (sysctlbyname("machdep.cpu.brand_string", model, &length, NULL, 0) != 0) {
+        snprintf(model, size, "unknown");
+    }
+#else
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f == NULL) {
+        return;
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+            colon += strspn(colon + 1, " \t") + 1;
+            colon[strcspn(colon, "\n")] = '\0';
+            snprintf(model, size, "%s", colon);
+            break;
+        }
+    }
+
+    fclose(f);
+#endif
+}
+
+// The file has a section for each CPU model and batch size, written by autotune:
+// [model name] batch 1
+// block 64
+// threads 4
+// parallel_min 1000000
+int ml_tuning_load(char *filename, size_t batch)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        return 0; // Not tuned yet
+    }
+
+    char cpu[256];
+    ml_cpu_model(cpu, sizeof(cpu));
+
+    int match = 0;
+    int found = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (line[0] == '[') {
+            char *end = strrchr(line, ']');
+            size_t section_batch = 0;
+            match = 0;
+            if (end != NULL && sscanf(end + 1, " batch %zu", &section_batch) == 1) {
+                *end = '\0';
+                match = strcmp(line + 1, cpu) == 0 && section_batch == batch;
+            }
+            found = found || match;
+            continue;
+        }
+
+        char key[64];
+        size_t value = 0;
+        if (!match || sscanf(line, "%63s %zu", key, &value) != 2) {
+            continue;
+        }
+
+        if (strcmp(key, "block") == 0 && value > 0) {
+            ml_tuning.block = value;
+        } else if (strcmp(key, "threads") == 0 && value > 0) {
+            ml_tuning.threads = value < ML_MAX_THREADS ? value : ML_MAX_THREADS;
+        } else if (strcmp(key, "parallel_min") == 0) {
+            ml_tuning.parallel_min = value;
+        }
+    }
+
+    fclose(f);
+    return found;
+}
+
 #endif // ML_IMPLEMENTATION
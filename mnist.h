@@ -0,0 +1,115 @@
+#ifndef MNIST_H_
+#define MNIST_H_
+
+// Readers for the MNIST dataset, shared by the training programs.
+// Include ml.h before this file.
+// Each set is read into a single matrix with one sample per row, and sample_at gives
+// a column vector view of a sample that can be bound to the input layer without copying.
+// This particular set's header is stored in big-endian format.
+// For little-endian computer the header must be flipped.
+
+int swap_endian(int x)
+{
+    return ((x >> 24) & 0xFF) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | ((x << 24) & 0xFF000000);
+}
+
+// One hot encoded, N x 10
+Mat read_labels(char *path, size_t N)
+{
+    FILE *f = fopen(path, "rb"); // Should probably check this return value, though
+    size_t ret = 0; // Just to get fewer warnings, these calls work 99% of the time
+
+    Mat labels = mat_alloc(N, 10);
+
+    // Read the magic number
+    int magic = 0;
+    ret = fread(&magic, sizeof(int), 1, f);
+    magic = swap_endian(magic);
+
+    // Read the number of items
+    int num_items = 0;
+    ret = fread(&num_items, sizeof(int), 1, f);
+    num_items = swap_endian(num_items);
+
+    // Convert the labels into rows of the matrix
+    for (size_t i = 0; i < N && i < (size_t) num_items; i++) {
+        unsigned char label;
+        ret = fread(&label, sizeof(char), 1, f);
+
+        MAT_AT(labels, i, (size_t) label) = 1.0;
+    }
+
+    fclose(f);
+
+    return labels;
+}
+
+// Flattened images, N x (rows * cols)
+Mat read_inputs(char *path, size_t N)
+{
+    FILE *f = fopen(path, "rb");
+    size_t ret = 0;
+
+    // Read magic number
+    int magic = 0;
+    ret = fread(&magic, sizeof(int), 1, f);
+    magic = swap_endian(magic);
+
+    // Read number of images
+    int num_items = 0;
+    ret = fread(&num_items, sizeof(int), 1, f);
+    num_items = swap_endian(num_items);
+
+    // Read number of rows
+    int rows = 0;
+    ret = fread(&rows, sizeof(int), 1, f);
+    rows = swap_endian(rows);
+
+    // Read number of columns
+    int cols = 0;
+    ret = fread(&cols, sizeof(int), 1, f);
+    cols = swap_endian(cols);
+
+    Mat inputs = mat_alloc(N, (size_t) rows * (size_t) cols);
+
+    // Read the images
+    for (size_t i = 0; i < N && i < (size_t) num_items; i++) {
+        // The image is stored row by row, so it is already flattened
+        Mat image = mat_reshape(mat_rows(inputs, i, 1), rows, cols);
+        for (size_t i = 0; i < (size_t) rows; i++) {
+            for (size_t j = 0; j < (size_t) cols; j++) {
+                unsigned char pixel = 0;
+                ret = fread(&pixel, sizeof(char), 1, f);
+                MAT_AT(image, i, j) = (double) pixel / 255.0; // Normalising the data improved accuracy a lot
+            }
+        }
+    }
+
+    fclose(f);
+
+    return inputs;
+}
+
+// Sample i of a set as a column vector view
+Mat sample_at(Mat set, size_t i)
+{
+    return mat_reshape(mat_rows(set, i, 1), set.cols, 1);
+}
+
+int mat_to_label(Mat m)
+{
+    int label = 0;
+    double max = 0.0;
+
+    for (size_t i = 0; i < m.rows; i++) {
+        if (MAT_AT(m, i, 0) > max) {
+            max = MAT_AT(m, i, 0);
+            label = (int) i;
+        }
+    }
+
+    return label;
+}
+
+
+#endif // MNIST_H_
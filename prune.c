@@ -0,0 +1,181 @@
+#include "ml.h"
+#include "mnist.h"
+
+// Magnitude pruning of a trained network, see net_prune.
+// Weights for input pixels that are black in every training image never contribute, so those
+// columns are zeroed first. The network is then pruned to each density below and tested on the
+// t10k set with the block sparse kernels, and the accuracy and speedup are printed for single
+// images and for batches.
+// The dense row uses the same loop order as the sparse kernels, so only the skipped blocks make a
+// difference: inf_gemv for single images, and sparse_mult with every block kept for batches.
+// The dead pixels row is measured against the dense row, and the densities against the dead pixels
+// row, so that the savings of magnitude pruning are not mixed up with the dead columns.
+//
+// Usage: ./prune [weights]
+// Reads weights_and_biases by default.
+
+#define BATCH 100
+#define RUNS 5 // The batch time is the best of these
+
+static const double densities[] = { 1.0, 0.5, 0.25, 0.1, 0.05 };
+
+// Returns the accuracy in percent and stores the mean time per image in seconds
+double test_inference(Inference e, Mat images, Mat labels, size_t C, double *seconds)
+{
+    int correct_guesses = 0;
+    double start = now();
+    for (size_t i = 0; i < C; i++) {
+        Mat out = inf_forward(e, sample_at(images, i));
+        if (mat_to_label(out) == mat_to_label(sample_at(labels, i))) {
+            correct_guesses++;
+        }
+    }
+    *seconds = (now() - start) / (double) C;
+
+    return (double) correct_guesses / (double) C * 100.0;
+}
+
+// Forward pass for a batch with one sample per column of as[0].
+// Returns the best time of RUNS passes in seconds.
+double forward_batch(Network n, Sparse *sparse, Mat *as)
+{
+    double best = INFINITY;
+    for (int run = 0; run < RUNS; run++) {
+        double start = now();
+        for (size_t i = 0; i < n.layer_count - 1; i++) {
+            sparse_mult(as[i+1], sparse[i], as[i]);
+            for (size_t r = 0; r < as[i+1].rows; r++) {
+                for (size_t c = 0; c < as[i+1].cols; c++) {
+                    MAT_AT(as[i+1], r, c) += MAT_AT(n.bs[i], r, 0);
+                }
+            }
+            if (i + 1 < n.layer_count - 1) {
+                mat_sigmoid(as[i+1]);
+            }
+        }
+        best = fmin(best, now() - start);
+    }
+
+    return best;
+}
+
+// Percentage of the weight blocks that s keeps
+double kept_blocks(Inference s)
+{
+    size_t kept = 0, total = 0;
+    for (size_t i = 0; i < s.layer_count - 1; i++) {
+        kept += s.sparse[i].block_count;
+        total += inf_padded(s.sizes[i+1]) / INF_PANEL * s.sizes[i];
+    }
+
+    return (double) kept / (double) total * 100.0;
+}
+
+// Zeroes the first layer weights of pixels that are zero in every image, returns how many there were
+size_t prune_dead_pixels(Network n, Mat images, size_t N)
+{
+    size_t dead = 0;
+    for (size_t k = 0; k < images.cols; k++) {
+        size_t i = 0;
+        while (i < N && MAT_AT(images, i, k) == 0.0) {
+            i++;
+        }
+        if (i < N) {
+            continue;
+        }
+
+        for (size_t r = 0; r < n.ws[0].rows; r++) {
+            MAT_AT(n.ws[0], r, k) = 0.0;
+        }
+        dead++;
+    }
+
+    return dead;
+}
+
+int main(int argc, char **argv)
+{
+    char *weights = argc > 1 ? argv[1] : "weights_and_biases";
+
+    size_t N = 60000;
+    size_t C = 10000;
+
+    Mat images = read_inputs("datasets/train-images-idx3-ubyte/train-images.idx3-ubyte", N);
+    Mat test_labels = read_labels("datasets/t10k-labels-idx1-ubyte", C);
+    Mat test_images = read_inputs("datasets/t10k-images-idx3-ubyte", C);
+
+    size_t arch[] = { 28*28, 1000, 100, 10 };
+    size_t layer_count = sizeof(arch)/sizeof(size_t);
+    Network n = net_alloc(layer_count, arch);
+    n.head = HEAD_SOFTMAX; // net_load checks it against the head train saved
+    net_load(n, weights);
+
+    // Activations for the batched forward pass
+    Mat as[sizeof(arch)/sizeof(size_t)];
+    as[0] = mat_transpose(mat_rows(test_images, 0, BATCH));
+    for (size_t i = 1; i < layer_count; i++) {
+        as[i] = mat_alloc(arch[i], BATCH);
+    }
+
+    // Dense baseline, the sparse weights of the unpruned network have every block
+    Inference e = inf_alloc(n);
+    double dense_seconds = 0.0;
+    double dense_accuracy = test_inference(e, test_images, test_labels, C, &dense_seconds);
+    inf_free(e);
+    e = inf_alloc_sparse(n);
+    double dense_batch = forward_batch(n, e.sparse, as);
+    inf_free(e);
+
+    size_t dead = prune_dead_pixels(n, images, N);
+    printf("%zu of %zu input pixels are zero in every training image\n", dead, images.cols);
+
+    // The reference for the densities, with only the dead pixel columns skipped
+    e = inf_alloc_sparse(n);
+    double dead_blocks = kept_blocks(e);
+    double dead_seconds = 0.0;
+    double dead_accuracy = test_inference(e, test_images, test_labels, C, &dead_seconds);
+    double dead_batch = forward_batch(n, e.sparse, as);
+    inf_free(e);
+
+    // Every density starts from the same parameters
+    size_t params = net_param_count(n);
+    double *original = (double *) malloc(sizeof(double) * params);
+    assert(original != NULL);
+    net_params_get(n, original);
+
+    printf("\n%8s %8s %9s %12s %8s %12s %8s\n",
+           "density", "blocks", "accuracy", "ms/image", "speedup", "ms/batch", "speedup");
+    printf("%8s %8s %8.2f%% %12.4f %8s %12.2f %8s\n",
+           "dense", "-", dense_accuracy, dense_seconds * 1e3, "1.00", dense_batch * 1e3, "1.00");
+    printf("%8s %7.1f%% %8.2f%% %12.4f %8.2f %12.2f %8.2f\n",
+           "dead px", dead_blocks, dead_accuracy, dead_seconds * 1e3, dense_seconds / dead_seconds,
+           dead_batch * 1e3, dense_batch / dead_batch);
+
+    for (size_t d = 0; d < sizeof(densities)/sizeof(densities[0]); d++) {
+        net_params_set(n, original);
+        net_prune(n, densities[d]);
+
+        Inference s = inf_alloc_sparse(n);
+
+        double seconds = 0.0;
+        double accuracy = test_inference(s, test_images, test_labels, C, &seconds);
+        double batch = forward_batch(n, s.sparse, as);
+
+        printf("%8.2f %7.1f%% %8.2f%% %12.4f %8.2f %12.2f %8.2f\n",
+               densities[d], kept_blocks(s), accuracy,
+               seconds * 1e3, dead_seconds / seconds, batch * 1e3, dead_batch / batch);
+
+        inf_free(s);
+    }
+
+    free(original);
+    for (size_t i = 0; i < layer_count; i++) {
+        mat_free(as[i]);
+    }
+    net_free(n);
+    mat_free(images);
+    mat_free(test_labels);
+    mat_free(test_images);
+
+    return 0;
+}
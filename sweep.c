@@ -0,0 +1,177 @@
+#define _DEFAULT_SOURCE // clock_gettime and sysconf with -std=c11
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "ml.h"
+#include "mnist.h"
+
+// Hyperparameter sweep on MNIST.
+// The dataset is read once and shared read-only by a pool of threads, which train one
+// configuration each at a time. Every combination of the architectures and learning rates
+// below is trained, and a table of accuracy, wall time and samples/sec is printed at the end.
+//
+// Usage: ./sweep [threads]
+// The number of threads defaults to the number of online CPUs.
+
+#define MAX_LAYERS 8
+#define MAX_THREADS 64
+
+typedef struct Config
+{
+    size_t layer_count;
+    size_t arch[MAX_LAYERS];
+    double learning_rate;
+
+    // Results
+    double accuracy;
+    double seconds;
+} Config;
+
+static const size_t archs[][MAX_LAYERS] = {
+    { 28*28, 1000, 100, 10 },
+    { 28*28, 500, 100, 10 },
+    { 28*28, 100, 10 },
+};
+static const double learning_rates[] = { 0.1, 0.01, 0.001 };
+
+typedef struct Sweep
+{
+    Config *configs;
+    size_t count;
+    atomic_size_t next; // Next configuration to train
+
+    Mat images, labels;
+    size_t N;
+    Mat test_images, test_labels;
+    size_t C;
+    size_t epochs;
+    unsigned int seed;
+    pthread_mutex_t alloc_lock; // net_alloc uses rand()
+} Sweep;
+
+void run_config(Sweep *s, Config *c)
+{
+    // Every configuration starts from the same seed
+    pthread_mutex_lock(&s->alloc_lock);
+    srand(s->seed);
+    Network n = net_alloc_fused(c->layer_count, c->arch);
+    pthread_mutex_unlock(&s->alloc_lock);
+    n.head = HEAD_SOFTMAX; // Same head as train
+
+    double start = now();
+    for (size_t e = 0; e < s->epochs; e++) {
+        for (size_t i = 0; i < s->N; i++) {
+            net_train(n, sample_at(s->images, i), sample_at(s->labels, i), c->learning_rate);
+        }
+    }
+    c->seconds = now() - start;
+
+    Inference e = inf_alloc(n);
+    int correct_guesses = 0;
+    for (size_t i = 0; i < s->C; i++) {
+        Mat out = inf_forward(e, sample_at(s->test_images, i));
+        if (mat_to_label(out) == mat_to_label(sample_at(s->test_labels, i))) {
+            correct_guesses++;
+        }
+    }
+    c->accuracy = (double) correct_guesses / (double) s->C * 100.0;
+
+    inf_free(e);
+    net_free(n);
+}
+
+void *sweep_worker(void *arg)
+{
+    Sweep *s = arg;
+    for (size_t i = atomic_fetch_add(&s->next, 1); i < s->count; i = atomic_fetch_add(&s->next, 1)) {
+        run_config(s, &s->configs[i]);
+        printf("Finished configuration %zu of %zu\n", i+1, s->count); fflush(stdout);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = online > 0 ? (size_t) online : 1;
+    if (argc > 1) {
+        long t = strtol(argv[1], NULL, 10);
+        if (t < 1 || t > MAX_THREADS) {
+            fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+            return EXIT_FAILURE;
+        }
+        threads = (size_t) t;
+    }
+    if (threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+
+    Sweep s;
+    s.N = 60000;
+    s.C = 10000;
+    s.epochs = 5;
+    s.seed = time(NULL);
+    pthread_mutex_init(&s.alloc_lock, NULL);
+
+    s.labels = read_labels("datasets/train-labels-idx1-ubyte/train-labels.idx1-ubyte", s.N);
+    s.images = read_inputs("datasets/train-images-idx3-ubyte/train-images.idx3-ubyte", s.N);
+    s.test_labels = read_labels("datasets/t10k-labels-idx1-ubyte", s.C);
+    s.test_images = read_inputs("datasets/t10k-images-idx3-ubyte", s.C);
+
+    // Every combination of architecture and learning rate
+    size_t arch_count = sizeof(archs)/sizeof(archs[0]);
+    size_t rate_count = sizeof(learning_rates)/sizeof(learning_rates[0]);
+    s.count = arch_count * rate_count;
+    s.configs = calloc(s.count, sizeof(Config));
+    assert(s.configs != NULL);
+    for (size_t a = 0; a < arch_count; a++) {
+        for (size_t r = 0; r < rate_count; r++) {
+            Config *c = &s.configs[a * rate_count + r];
+            while (c->layer_count < MAX_LAYERS && archs[a][c->layer_count] != 0) {
+                c->arch[c->layer_count] = archs[a][c->layer_count];
+                c->layer_count++;
+            }
+            c->learning_rate = learning_rates[r];
+        }
+    }
+    atomic_init(&s.next, 0);
+
+    double start = now();
+    pthread_t ids[MAX_THREADS];
+    for (size_t t = 0; t < threads; t++) {
+        if (pthread_create(&ids[t], NULL, sweep_worker, &s) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    for (size_t t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+    }
+    double total = now() - start;
+
+    printf("\n%-24s %8s %9s %10s %12s\n", "architecture", "rate", "accuracy", "seconds", "samples/sec");
+    for (size_t i = 0; i < s.count; i++) {
+        Config *c = &s.configs[i];
+
+        char arch[128] = "";
+        size_t len = 0;
+        for (size_t l = 0; l < c->layer_count && len < sizeof(arch); l++) {
+            len += snprintf(arch + len, sizeof(arch) - len, l == 0 ? "%zu" : "-%zu", c->arch[l]);
+        }
+
+        printf("%-24s %8g %8.2f%% %10.1f %12.0f\n", arch, c->learning_rate, c->accuracy,
+               c->seconds, s.N * s.epochs / c->seconds);
+    }
+    printf("\n%zu configurations on %zu threads in %.1f seconds\n", s.count, threads, total);
+
+    pthread_mutex_destroy(&s.alloc_lock);
+    free(s.configs);
+    mat_free(s.labels);
+    mat_free(s.images);
+    mat_free(s.test_labels);
+    mat_free(s.test_images);
+
+    return 0;
+}
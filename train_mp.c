@@ -0,0 +1,283 @@
+#define _DEFAULT_SOURCE // mmap(MAP_ANONYMOUS) and clock_gettime with -std=c11
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ml.h"
+#include "mnist.h"
+
+// Data parallel training on MNIST with several worker processes.
+// Each worker runs the normal per-sample training on its own shard of the training set.
+// Every SYNC_EVERY samples the workers average their parameters with a ring all-reduce
+// over a shared memory mapping that holds one flat parameter buffer per worker.
+//
+// Usage: ./train_mp [workers...]
+// Trains once for each worker count given (1 2 4 8 by default) and prints a scaling table.
+
+#define MAX_WORKERS 64
+#define SYNC_EVERY 500
+
+// Sense reversing barrier, placed in the shared mapping so it works across processes
+typedef struct Barrier
+{
+    atomic_size_t arrived;
+    atomic_int sense;
+    size_t count;
+} Barrier;
+
+typedef struct Shared
+{
+    Barrier barrier;
+    size_t workers;
+    size_t params;
+    double *bufs; // workers * params doubles, directly after this struct in the mapping
+} Shared;
+
+void barrier_wait(Barrier *b, int *local_sense)
+{
+    *local_sense = !*local_sense;
+    if (atomic_fetch_add(&b->arrived, 1) == b->count - 1) {
+        atomic_store(&b->arrived, 0);
+        atomic_store(&b->sense, *local_sense);
+    } else {
+        while (atomic_load(&b->sense) != *local_sense) {
+            sched_yield();
+        }
+    }
+}
+
+double *shared_buf(Shared *s, size_t rank)
+{
+    return s->bufs + rank * s->params;
+}
+
+// Sums the buffers of all workers into every buffer.
+// The parameters are split into one chunk per worker. In the reduce-scatter phase each worker
+// adds its left neighbour's partial chunk to its own, after which worker r holds the full sum
+// of chunk r+1. The all-gather phase then passes the finished chunks around the ring.
+void ring_allreduce(Shared *s, size_t rank, int *sense)
+{
+    size_t w = s->workers;
+    double *mine = shared_buf(s, rank);
+    double *left = shared_buf(s, (rank + w - 1) % w);
+
+    for (size_t step = 0; step < w - 1; step++) {
+        size_t c = (rank + 2*w - step - 1) % w;
+        size_t begin = c * s->params / w;
+        size_t end = (c + 1) * s->params / w;
+        for (size_t i = begin; i < end; i++) {
+            mine[i] += left[i];
+        }
+        barrier_wait(&s->barrier, sense);
+    }
+
+    for (size_t step = 0; step < w - 1; step++) {
+        size_t c = (rank + w - step) % w;
+        size_t begin = c * s->params / w;
+        size_t end = (c + 1) * s->params / w;
+        memcpy(mine + begin, left + begin, (end - begin) * sizeof(double));
+        barrier_wait(&s->barrier, sense);
+    }
+}
+
+void average_params(Network n, Shared *s, size_t rank, int *sense)
+{
+    double *mine = shared_buf(s, rank);
+
+    net_params_get(n, mine);
+    barrier_wait(&s->barrier, sense);
+
+    ring_allreduce(s, rank, sense);
+
+    for (size_t i = 0; i < s->params; i++) {
+        mine[i] /= (double) s->workers;
+    }
+    net_params_set(n, mine);
+}
+
+void worker(Network n, Shared *s, size_t rank, Mat images, Mat labels, size_t N, size_t epochs, double learning_rate)
+{
+    int sense = 0;
+
+    // Any remainder after splitting the set evenly is skipped
+    size_t shard = N / s->workers;
+    size_t first = rank * shard;
+
+    for (size_t e = 0; e < epochs; e++) {
+        for (size_t j = 0; j < shard; j += SYNC_EVERY) {
+            for (size_t k = j; k < j + SYNC_EVERY && k < shard; k++) {
+                net_train(n, sample_at(images, first + k), sample_at(labels, first + k), learning_rate);
+            }
+            if (s->workers > 1) {
+                average_params(n, s, rank, &sense);
+            }
+        }
+        if (rank == 0) {
+            printf("\rEpoch %zu of %zu", e+1, epochs); fflush(stdout); // Print the progress
+        }
+    }
+
+    // Leave the final parameters for the parent
+    if (rank == 0) {
+        net_params_get(n, shared_buf(s, 0));
+    }
+}
+
+// Trains n with the given number of worker processes and returns the wall time in seconds
+double train_parallel(Network n, size_t workers, Mat images, Mat labels, size_t N, size_t epochs, double learning_rate)
+{
+    size_t params = net_param_count(n);
+    size_t size = sizeof(Shared) + workers * params * sizeof(double);
+
+    Shared *s = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&s->barrier.arrived, 0);
+    atomic_init(&s->barrier.sense, 0);
+    s->barrier.count = workers;
+    s->workers = workers;
+    s->params = params;
+    s->bufs = (double *) (s + 1);
+
+    double start = now();
+
+    // The children get copy-on-write views of the network and the dataset.
+    // They would also get a copy of anything still buffered in stdout and print it again.
+    fflush(stdout);
+    pid_t pids[MAX_WORKERS];
+    for (size_t r = 0; r < workers; r++) {
+        pids[r] = fork();
+        if (pids[r] < 0) {
+            perror("fork failed");
+            exit(EXIT_FAILURE);
+        }
+        if (pids[r] == 0) {
+            worker(n, s, r, images, labels, N, epochs, learning_rate);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    // Reap the workers in the order they finish. The others would wait for a failed worker
+    // in barrier_wait forever, so they are killed as soon as one fails.
+    int finished[MAX_WORKERS] = { 0 };
+    for (size_t done = 0; done < workers; done++) {
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            perror("waitpid failed");
+            exit(EXIT_FAILURE);
+        }
+
+        size_t r = 0;
+        while (r < workers && pids[r] != pid) {
+            r++;
+        }
+        if (r < workers) {
+            finished[r] = 1;
+        }
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            fprintf(stderr, "Worker %zu failed\n", r);
+            for (size_t k = 0; k < workers; k++) {
+                if (!finished[k]) {
+                    kill(pids[k], SIGKILL);
+                    waitpid(pids[k], NULL, 0);
+                }
+            }
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double elapsed = now() - start;
+
+    net_params_set(n, shared_buf(s, 0));
+    munmap(s, size);
+
+    return elapsed;
+}
+
+double test_accuracy(Network n, Mat images, Mat labels, size_t C)
+{
+    Inference e = inf_alloc(n);
+
+    int correct_guesses = 0;
+    for (size_t i = 0; i < C; i++) {
+        Mat out = inf_forward(e, sample_at(images, i));
+        if (mat_to_label(out) == mat_to_label(sample_at(labels, i))) {
+            correct_guesses++;
+        }
+    }
+
+    inf_free(e);
+    return (double) correct_guesses / (double) C * 100.0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t counts[MAX_WORKERS] = { 1, 2, 4, 8 };
+    size_t runs = 4;
+    if (argc > 1) {
+        runs = 0;
+        for (int i = 1; i < argc && runs < MAX_WORKERS; i++) {
+            long w = strtol(argv[i], NULL, 10);
+            if (w < 1 || w > MAX_WORKERS) {
+                fprintf(stderr, "Worker count must be between 1 and %d\n", MAX_WORKERS);
+                return EXIT_FAILURE;
+            }
+            counts[runs++] = (size_t) w;
+        }
+    }
+
+    size_t N = 60000;
+    size_t C = 10000;
+
+    // The dataset is read once and shared with every worker
+    Mat labels = read_labels("datasets/train-labels-idx1-ubyte/train-labels.idx1-ubyte", N);
+    Mat images = read_inputs("datasets/train-images-idx3-ubyte/train-images.idx3-ubyte", N);
+    Mat test_labels = read_labels("datasets/t10k-labels-idx1-ubyte", C);
+    Mat test_images = read_inputs("datasets/t10k-images-idx3-ubyte", C);
+
+    double learning_rate = 0.01;
+    size_t epochs = 5;
+    size_t arch[] = { 28*28, 1000, 100, 10 };
+    unsigned int seed = time(NULL);
+
+    double times[MAX_WORKERS];
+    double accuracies[MAX_WORKERS];
+    for (size_t r = 0; r < runs; r++) {
+        // Every run starts from the same parameters
+        srand(seed);
+        Network n = net_alloc(sizeof(arch)/sizeof(size_t), arch);
+        n.head = HEAD_SOFTMAX; // Saved with the weights, and checked when they are loaded
+
+        times[r] = train_parallel(n, counts[r], images, labels, N, epochs, learning_rate);
+        accuracies[r] = test_accuracy(n, test_images, test_labels, C);
+        printf("\r%zu workers: %.1f s, %.2f percent\n", counts[r], times[r], accuracies[r]);
+
+        // Keep the parameters from the last run
+        if (r == runs - 1) {
+            net_save(n, "weights_and_biases");
+        }
+        net_free(n);
+    }
+
+    // Speedup is relative to the first run
+    printf("\n%8s %10s %14s %8s %9s\n", "workers", "seconds", "samples/sec", "speedup", "accuracy");
+    for (size_t r = 0; r < runs; r++) {
+        size_t samples = N / counts[r] * counts[r] * epochs;
+        printf("%8zu %10.1f %14.0f %8.2f %8.2f%%\n",
+               counts[r], times[r], samples / times[r], times[0] / times[r], accuracies[r]);
+    }
+
+    mat_free(labels);
+    mat_free(images);
+    mat_free(test_labels);
+    mat_free(test_images);
+
+    return 0;
+}